@@ -14,12 +14,48 @@
 #include "../graph.h"
 #include "sparse_vector.h"
 #include <sstream>
+#include <algorithm>
+#include <utility>
 
 // ----------------------------------------------------------------------------------------
 
 namespace dlib
 {
 
+// ----------------------------------------------------------------------------------------
+
+    namespace impl
+    {
+        template <typename T>
+        typename enable_if<is_matrix<T>,bool>::type contains_negative_value (
+            const T& vect
+        )
+        {
+            // Equivalent to min(vect) < 0 but scans the values directly, without
+            // the full reduction bookkeeping, and stops at the first offender.
+            for (long k = 0; k < vect.size(); ++k)
+            {
+                if (vect(k) < 0)
+                    return true;
+            }
+            return false;
+        }
+
+        template <typename T>
+        typename disable_if<is_matrix<T>,bool>::type contains_negative_value (
+            const T& vect
+        )
+        {
+            // For sparse vectors only explicitly stored values can be negative.
+            for (typename T::const_iterator i = vect.begin(); i != vect.end(); ++i)
+            {
+                if (i->second < 0)
+                    return true;
+            }
+            return false;
+        }
+    }
+
 // ----------------------------------------------------------------------------------------
 
     template <
@@ -38,7 +74,6 @@ namespace dlib
                             (!is_matrix<node_vector_type>::value && !is_matrix<edge_vector_type>::value));
                             
 
-        std::ostringstream sout;
         reason_for_failure.clear();
 
         if (!is_learning_problem(samples, labels))
@@ -49,70 +84,106 @@ namespace dlib
 
         const bool ismat = is_matrix<typename graph_type::type>::value;
 
-        // these are -1 until assigned with a value
+        // Establish the expected node and edge vector dimensions from the first node
+        // and edge in the dataset.  These are -1 until assigned with a value.
         long node_dims = -1;
         long edge_dims = -1;
+        if (ismat)
+        {
+            for (unsigned long i = 0; i < samples.size() && (node_dims == -1 || edge_dims == -1); ++i)
+            {
+                for (unsigned long j = 0; j < samples[i].number_of_nodes() && (node_dims == -1 || edge_dims == -1); ++j)
+                {
+                    if (node_dims == -1)
+                        node_dims = samples[i].node(j).data.size();
+                    if (edge_dims == -1 && samples[i].node(j).number_of_neighbors() != 0)
+                        edge_dims = samples[i].node(j).edge(0).size();
+                }
+            }
+        }
+
+        // The remaining checks are independent across samples, so run them in
+        // parallel and report the failure with the smallest sample index so the
+        // error message doesn't depend on thread scheduling.
+        mutex failure_mutex;
+        unsigned long first_failure = samples.size();
+        std::string failure_message;
 
-        for (unsigned long i = 0; i < samples.size(); ++i)
+        parallel_for(0, (long)samples.size(), [&](long k)
         {
+            const unsigned long i = k;
+            std::ostringstream sout;
+
             if (samples[i].number_of_nodes() != labels[i].size())
             {
                 sout << "samples["<<i<<"].number_of_nodes() doesn't match labels["<<i<<"].size().";
-                reason_for_failure = sout.str();
-                return false;
             }
-            if (graph_contains_length_one_cycle(samples[i]))
+            else if (graph_contains_length_one_cycle(samples[i]))
             {
                 sout << "graph_contains_length_one_cycle(samples["<<i<<"]) returned true.";
-                reason_for_failure = sout.str();
-                return false;
             }
-
-            for (unsigned long j = 0; j < samples[i].number_of_nodes(); ++j)
+            else
             {
-                if (ismat && samples[i].node(j).data.size() == 0)
-                {
-                    sout << "A graph contains an empty vector at node: samples["<<i<<"].node("<<j<<").data.";
-                    reason_for_failure = sout.str();
-                    return false;
-                }
-
-                if (ismat && node_dims == -1)
-                    node_dims = samples[i].node(j).data.size();
-                // all nodes must have vectors of the same size. 
-                if (ismat && (long)samples[i].node(j).data.size() != node_dims)
-                {
-                    sout << "Not all node vectors in samples["<<i<<"] are the same dimension.";
-                    reason_for_failure = sout.str();
-                    return false;
-                }
-
-                for (unsigned long n = 0; n < samples[i].node(j).number_of_neighbors(); ++n)
+                for (unsigned long j = 0; j < samples[i].number_of_nodes(); ++j)
                 {
-                    if (ismat && samples[i].node(j).edge(n).size() == 0)
+                    if (ismat && samples[i].node(j).data.size() == 0)
                     {
-                        sout << "A graph contains an empty vector at edge: samples["<<i<<"].node("<<j<<").edge("<<n<<").";
-                        reason_for_failure = sout.str();
-                        return false;
+                        sout << "A graph contains an empty vector at node: samples["<<i<<"].node("<<j<<").data.";
+                        break;
                     }
-                    if (min(samples[i].node(j).edge(n)) < 0)
+
+                    // all nodes must have vectors of the same size.
+                    if (ismat && (long)samples[i].node(j).data.size() != node_dims)
                     {
-                        sout << "A graph contains negative values on an edge vector at: samples["<<i<<"].node("<<j<<").edge("<<n<<").";
-                        reason_for_failure = sout.str();
-                        return false;
+                        sout << "Not all node vectors in samples["<<i<<"] are the same dimension.";
+                        break;
                     }
 
-                    if (ismat && edge_dims == -1)
-                        edge_dims = samples[i].node(j).edge(n).size();
-                    // all edges must have vectors of the same size.
-                    if (ismat && (long)samples[i].node(j).edge(n).size() != edge_dims)
+                    bool bad_edge = false;
+                    for (unsigned long n = 0; n < samples[i].node(j).number_of_neighbors(); ++n)
                     {
-                        sout << "Not all edge vectors in samples["<<i<<"] are the same dimension.";
-                        reason_for_failure = sout.str();
-                        return false;
+                        if (ismat && samples[i].node(j).edge(n).size() == 0)
+                        {
+                            sout << "A graph contains an empty vector at edge: samples["<<i<<"].node("<<j<<").edge("<<n<<").";
+                            bad_edge = true;
+                            break;
+                        }
+                        if (impl::contains_negative_value(samples[i].node(j).edge(n)))
+                        {
+                            sout << "A graph contains negative values on an edge vector at: samples["<<i<<"].node("<<j<<").edge("<<n<<").";
+                            bad_edge = true;
+                            break;
+                        }
+
+                        // all edges must have vectors of the same size.
+                        if (ismat && (long)samples[i].node(j).edge(n).size() != edge_dims)
+                        {
+                            sout << "Not all edge vectors in samples["<<i<<"] are the same dimension.";
+                            bad_edge = true;
+                            break;
+                        }
                     }
+                    if (bad_edge)
+                        break;
                 }
             }
+
+            const std::string reason = sout.str();
+            if (reason.size() != 0)
+            {
+                auto_mutex lock(failure_mutex);
+                if (i < first_failure)
+                {
+                    first_failure = i;
+                    failure_message = reason;
+                }
+            }
+        });
+
+        if (first_failure != samples.size())
+        {
+            reason_for_failure = failure_message;
+            return false;
         }
 
         return true;
@@ -254,20 +325,95 @@ namespace dlib
             loss_pos = 1.0;
             loss_neg = 1.0;
 
-            // figure out how many dimensions are in the node and edge vectors.
+            // Figure out how many dimensions are in the node and edge vectors.  The
+            // scan is independent per sample, so compute per-sample maxima in
+            // parallel and then reduce them serially.
+            std::vector<long> sample_node_dims(samples.size(), 0);
+            std::vector<long> sample_edge_dims(samples.size(), 0);
+            parallel_for(num_threads, 0, (long)samples.size(), [&](long i)
+            {
+                long nd = 0;
+                long ed = 0;
+                for (unsigned long j = 0; j < samples[i].number_of_nodes(); ++j)
+                {
+                    nd = std::max(nd,(long)max_index_plus_one(samples[i].node(j).data));
+                    for (unsigned long n = 0; n < samples[i].node(j).number_of_neighbors(); ++n)
+                    {
+                        ed = std::max(ed, (long)max_index_plus_one(samples[i].node(j).edge(n)));
+                    }
+                }
+                sample_node_dims[i] = nd;
+                sample_edge_dims[i] = ed;
+            });
+
             node_dims = 0;
             edge_dims = 0;
             for (unsigned long i = 0; i < samples.size(); ++i)
             {
-                for (unsigned long j = 0; j < samples[i].number_of_nodes(); ++j)
+                node_dims = std::max(node_dims, sample_node_dims[i]);
+                edge_dims = std::max(edge_dims, sample_edge_dims[i]);
+            }
+
+            // Materialize each sample's adjacency as flat index arrays.  The hot
+            // loops below only need the neighbor node indices, and reading them
+            // from contiguous memory avoids chasing pointers through the graph
+            // node objects on every oracle call.  adj_offsets[s][i] gives where
+            // node i's neighbors start in adj_idx[s], with one extra end entry.
+            adj_idx.resize(samples.size());
+            adj_offsets.resize(samples.size());
+            for (unsigned long s = 0; s < samples.size(); ++s)
+            {
+                adj_offsets[s].push_back(0);
+                for (unsigned long i = 0; i < samples[s].number_of_nodes(); ++i)
                 {
-                    node_dims = std::max(node_dims,(long)max_index_plus_one(samples[i].node(j).data));
-                    for (unsigned long n = 0; n < samples[i].node(j).number_of_neighbors(); ++n)
+                    for (unsigned long n = 0; n < samples[s].node(i).number_of_neighbors(); ++n)
+                        adj_idx[s].push_back(samples[s].node(i).neighbor(n).index());
+                    adj_offsets[s].push_back(adj_idx[s].size());
+                }
+            }
+
+            build_feature_cache(samples);
+
+            // The separation oracle needs a graph<double,double> with the same
+            // structure as each sample.  The structure never changes across oracle
+            // calls, so build these once here and just overwrite the node and edge
+            // data during each call rather than rebuilding the whole graph.
+            scratch_graphs.resize(samples.size());
+            scratch_edge_pos.resize(samples.size());
+            for (unsigned long s = 0; s < samples.size(); ++s)
+            {
+                copy_graph_structure(samples[s], scratch_graphs[s]);
+
+                // copy_graph_structure() doesn't necessarily keep each node's
+                // neighbors in the same order as the original graph.  So for every
+                // i<j edge, in the order the oracle walks the sample, record which
+                // neighbor slot of node i holds that edge in the scratch graph so
+                // the oracle can write each edge weight straight to the right place.
+                for (unsigned long i = 0; i < samples[s].number_of_nodes(); ++i)
+                {
+                    for (unsigned long n = 0; n < samples[s].node(i).number_of_neighbors(); ++n)
                     {
-                        edge_dims = std::max(edge_dims, (long)max_index_plus_one(samples[i].node(j).edge(n)));
+                        const unsigned long j = samples[s].node(i).neighbor(n).index();
+                        if (i < j)
+                        {
+                            for (unsigned long m = 0; m < scratch_graphs[s].node(i).number_of_neighbors(); ++m)
+                            {
+                                if (scratch_graphs[s].node(i).neighbor(m).index() == j)
+                                {
+                                    scratch_edge_pos[s].push_back(m);
+                                    break;
+                                }
+                            }
+                        }
                     }
                 }
             }
+
+            // Holds the labeling found by the most recent oracle call for each
+            // sample.  Keeping these around means find_max_factor_graph_potts()
+            // writes into an already sized buffer instead of a freshly allocated
+            // vector on every call.
+            labeling_scratch.resize(samples.size());
         }
 
         const std::vector<std::vector<double> >& get_losses (
@@ -333,8 +479,96 @@ namespace dlib
 
 
     private:
+
+        template <typename T>
+        typename enable_if<is_matrix<typename T::type> >::type build_feature_cache (
+            const dlib::array<T>& samps
+        )
+        /*!
+            ensures
+                - populates node_feat and edge_feat with flattened copies of the
+                  feature vectors in samps.  Stacking them into one contiguous
+                  matrix per sample lets the hot loops below scan sequential
+                  memory instead of chasing pointers through the graph containers.
+        !*/
+        {
+            node_feat.resize(samps.size());
+            edge_feat.resize(samps.size());
+            for (unsigned long s = 0; s < samps.size(); ++s)
+            {
+                const T& samp = samps[s];
+
+                node_feat[s].set_size(samp.number_of_nodes(), node_dims);
+                unsigned long num_edges = 0;
+                for (unsigned long i = 0; i < samp.number_of_nodes(); ++i)
+                {
+                    for (long k = 0; k < node_dims; ++k)
+                        node_feat[s](i,k) = samp.node(i).data(k);
+
+                    for (unsigned long n = 0; n < samp.node(i).number_of_neighbors(); ++n)
+                    {
+                        if (i < samp.node(i).neighbor(n).index())
+                            ++num_edges;
+                    }
+                }
+
+                // One row per i<j edge, in the order the loops in this class walk
+                // the graph.
+                edge_feat[s].set_size(num_edges, edge_dims);
+                unsigned long r = 0;
+                for (unsigned long i = 0; i < samp.number_of_nodes(); ++i)
+                {
+                    for (unsigned long n = 0; n < samp.node(i).number_of_neighbors(); ++n)
+                    {
+                        if (i < samp.node(i).neighbor(n).index())
+                        {
+                            for (long k = 0; k < edge_dims; ++k)
+                                edge_feat[s](r,k) = samp.node(i).edge(n)(k);
+                            ++r;
+                        }
+                    }
+                }
+            }
+        }
+
+        template <typename T>
+        typename disable_if<is_matrix<typename T::type> >::type build_feature_cache (
+            const dlib::array<T>& samps
+        )
+        {
+            // Pack the sparse edge vectors into one contiguous index/value array
+            // per sample, CSR style, so the oracle can score edges by scanning
+            // sequential memory rather than walking each sparse container's
+            // iterators.  Sparse node vectors are still used directly out of the
+            // graphs.
+            sparse_edge_vals.resize(samps.size());
+            sparse_edge_offsets.resize(samps.size());
+            for (unsigned long s = 0; s < samps.size(); ++s)
+            {
+                const T& samp = samps[s];
+                std::vector<std::pair<unsigned long,double> >& vals = sparse_edge_vals[s];
+                std::vector<unsigned long>& offsets = sparse_edge_offsets[s];
+                offsets.push_back(0);
+                for (unsigned long i = 0; i < samp.number_of_nodes(); ++i)
+                {
+                    for (unsigned long n = 0; n < samp.node(i).number_of_neighbors(); ++n)
+                    {
+                        // One offset entry per i<j edge, in the order the loops in
+                        // this class walk the graph.
+                        if (i < samp.node(i).neighbor(n).index())
+                        {
+                            const typename T::edge_type& e = samp.node(i).edge(n);
+                            for (typename T::edge_type::const_iterator it = e.begin(); it != e.end(); ++it)
+                                vals.push_back(std::make_pair((unsigned long)it->first, (double)it->second));
+                            offsets.push_back(vals.size());
+                        }
+                    }
+                }
+            }
+        }
+
         virtual long get_num_dimensions (
-        ) const 
+        ) const
         {
             // The psi/w vector will begin with all the edge dims and then follow with the node dims.
             return edge_dims + node_dims;
@@ -346,86 +580,146 @@ namespace dlib
             return samples.size();
         }
 
-        template <typename psi_type>
+        // The label vector can be either a std::vector<bool> of true labels or the
+        // std::vector<node_label> produced by find_max_factor_graph_potts().  A
+        // node is treated as positively labeled when its entry is nonzero.
+        template <typename psi_type, typename label_vector_type>
         typename enable_if<is_matrix<psi_type> >::type get_joint_feature_vector (
-            const sample_type& sample, 
-            const label_type& label,
+            const long idx,
+            const label_vector_type& label,
             psi_type& psi
-        ) const 
+        ) const
         {
+            const sample_type& sample = samples[idx];
+            const std::vector<unsigned long>& adj = adj_idx[idx];
+            const std::vector<unsigned long>& adj_off = adj_offsets[idx];
+
+            typedef typename psi_type::type scalar_type;
+
+            // When the node/edge vectors have compile time sizes, use those as the
+            // loop bounds below instead of the runtime node_dims/edge_dims so the
+            // compiler can fully unroll and vectorize the accumulations.  These
+            // fold to the runtime values when the matrices are dynamically sized
+            // (NR or NC of 0).
+            const long static_node_size = sample_type::type::NR * sample_type::type::NC;
+            const long static_edge_size = sample_type::edge_type::NR * sample_type::edge_type::NC;
+            const long Nn = (static_node_size != 0) ? static_node_size : node_dims;
+            const long Ne = (static_edge_size != 0) ? static_edge_size : edge_dims;
+
             psi.set_size(get_num_dimensions());
             psi = 0;
+            // Accumulate into psi's node and edge blocks through raw pointers.  Going
+            // through set_subm() here makes the compiler evaluate an expression
+            // template object for every node and edge, while these plain loops compile
+            // down to straight vectorizable adds over contiguous memory.
+            scalar_type* const psi_edge = &psi(0);
+            scalar_type* const psi_node = psi_edge + edge_dims;
             for (unsigned long i = 0; i < sample.number_of_nodes(); ++i)
             {
+                const bool label_i = (label[i] != 0);
+
                 // accumulate the node vectors
-                if (label[i] == true)
-                    set_rowm(psi, range(edge_dims, psi.size()-1)) += sample.node(i).data;
+                if (label_i)
+                {
+                    const typename sample_type::type& data = sample.node(i).data;
+                    for (long k = 0; k < Nn; ++k)
+                        psi_node[k] += data(k);
+                }
 
                 for (unsigned long n = 0; n < sample.node(i).number_of_neighbors(); ++n)
                 {
-                    const unsigned long j = sample.node(i).neighbor(n).index();
+                    const unsigned long j = adj[adj_off[i]+n];
 
                     // Don't double count edges.  Also only include the vector if
                     // the labels disagree.
-                    if (i < j && label[i] != label[j])
+                    if (i < j && label_i != (label[j] != 0))
                     {
-                        set_rowm(psi, range(0, edge_dims-1)) -= sample.node(i).edge(n);
+                        const typename sample_type::edge_type& e = sample.node(i).edge(n);
+                        for (long k = 0; k < Ne; ++k)
+                            psi_edge[k] -= e(k);
                     }
                 }
             }
         }
 
+        typedef std::vector<std::pair<unsigned long,double> > sparse_accum_type;
+
         template <typename T>
         void add_to_sparse_vect (
-            T& psi,
+            sparse_accum_type& buf,
             const T& vect,
-            unsigned long offset 
+            unsigned long offset
         ) const
         {
             for (typename T::const_iterator i = vect.begin(); i != vect.end(); ++i)
             {
-                psi.insert(psi.end(), std::make_pair(i->first+offset, i->second));
+                buf.push_back(std::make_pair(i->first+offset, (double)i->second));
             }
         }
 
         template <typename T>
         void subtract_from_sparse_vect (
-            T& psi,
+            sparse_accum_type& buf,
             const T& vect
         ) const
         {
             for (typename T::const_iterator i = vect.begin(); i != vect.end(); ++i)
             {
-                psi.insert(psi.end(), std::make_pair(i->first, -i->second));
+                buf.push_back(std::make_pair((unsigned long)i->first, -(double)i->second));
             }
         }
 
-        template <typename psi_type>
+        template <typename psi_type, typename label_vector_type>
         typename disable_if<is_matrix<psi_type> >::type get_joint_feature_vector (
-            const sample_type& sample, 
-            const label_type& label,
+            const long idx,
+            const label_vector_type& label,
             psi_type& psi
-        ) const 
+        ) const
         {
-            psi.clear();
+            const sample_type& sample = samples[idx];
+            const std::vector<unsigned long>& adj = adj_idx[idx];
+            const std::vector<unsigned long>& adj_off = adj_offsets[idx];
+
+            // Append every contribution to a flat buffer and then sort and coalesce
+            // it once at the end rather than inserting into psi element by element.
+            // Besides skipping the per-insert container overhead, this guarantees
+            // psi comes out sorted with one entry per feature index.  In particular,
+            // map-like psi types used to silently drop repeated feature indices
+            // since their insert() ignores duplicate keys; summing the duplicates
+            // here gives the same totals for every sparse psi type.
+            sparse_accum_type buf;
             for (unsigned long i = 0; i < sample.number_of_nodes(); ++i)
             {
+                const bool label_i = (label[i] != 0);
+
                 // accumulate the node vectors
-                if (label[i] == true)
-                    add_to_sparse_vect(psi, sample.node(i).data, edge_dims);
+                if (label_i)
+                    add_to_sparse_vect(buf, sample.node(i).data, edge_dims);
 
                 for (unsigned long n = 0; n < sample.node(i).number_of_neighbors(); ++n)
                 {
-                    const unsigned long j = sample.node(i).neighbor(n).index();
+                    const unsigned long j = adj[adj_off[i]+n];
 
                     // Don't double count edges.  Also only include the vector if
                     // the labels disagree.
-                    if (i < j && label[i] != label[j])
+                    if (i < j && label_i != (label[j] != 0))
                     {
-                        subtract_from_sparse_vect(psi, sample.node(i).edge(n));
+                        subtract_from_sparse_vect(buf, sample.node(i).edge(n));
                     }
                 }
             }
+
+            std::sort(buf.begin(), buf.end());
+
+            psi.clear();
+            for (unsigned long i = 0; i < buf.size(); )
+            {
+                const unsigned long idx = buf[i].first;
+                double value = 0;
+                for (; i < buf.size() && buf[i].first == idx; ++i)
+                    value += buf[i].second;
+                psi.insert(psi.end(), std::make_pair(idx, value));
+            }
         }
 
         virtual void get_truth_joint_feature_vector (
@@ -433,7 +727,7 @@ namespace dlib
             feature_vector_type& psi 
         ) const 
         {
-            get_joint_feature_vector(samples[idx], labels[idx], psi);
+            get_joint_feature_vector(idx, labels[idx], psi);
         }
 
         virtual void separation_oracle (
@@ -445,13 +739,39 @@ namespace dlib
         {
             const sample_type& samp = samples[idx];
 
-            // setup the potts graph based on samples[idx] and current_solution.
-            graph<double,double>::kernel_1a g; 
-            copy_graph_structure(samp, g);
+            // Pull the edge and node weight blocks out of current_solution once, out
+            // here, rather than re-slicing current_solution for every node and edge in
+            // the loops below.
+            const matrix<double,0,1> w_edge = subm(current_solution, 0,0,         edge_dims,1);
+            const matrix<double,0,1> w_node = subm(current_solution, edge_dims,0, node_dims,1);
+
+            // If the features are dense then score them out of the flattened
+            // per-sample cache rather than the graph containers.  Doing all the
+            // nodes (and likewise all the edges) as one matrix-vector multiply
+            // replaces a pile of scattered dot() calls with a single BLAS style
+            // operation over contiguous memory.
+            const bool use_cache = is_matrix<typename sample_type::type>::value;
+            matrix<double,0,1> node_scores, edge_scores;
+            if (use_cache)
+            {
+                node_scores = node_feat[idx]*w_node;
+                edge_scores = edge_feat[idx]*w_edge;
+            }
+
+            // Setup the potts graph based on samples[idx] and current_solution.  We
+            // use the prebuilt scratch graph for this sample and just overwrite its
+            // node and edge data.  This is thread safe because the threaded solver
+            // in our base class hands each sample to at most one thread at a time.
+            graph<double,double>::kernel_1a& g = scratch_graphs[idx];
+            const std::vector<unsigned long>& adj = adj_idx[idx];
+            const std::vector<unsigned long>& adj_off = adj_offsets[idx];
+            unsigned long next_edge = 0;
             for (unsigned long i = 0; i < g.number_of_nodes(); ++i)
             {
-                g.node(i).data = dot(rowm(current_solution,range(edge_dims,current_solution.size()-1)),
-                                    samp.node(i).data);
+                if (use_cache)
+                    g.node(i).data = node_scores(i);
+                else
+                    g.node(i).data = dot(w_node, samp.node(i).data);
 
                 // Include a loss augmentation so that we will get the proper loss augmented
                 // max when we use find_max_factor_graph_potts() below.
@@ -460,36 +780,56 @@ namespace dlib
                 else
                     g.node(i).data += get_loss_for_sample(idx,i,!labels[idx][i]);
 
-                for (unsigned long n = 0; n < g.node(i).number_of_neighbors(); ++n)
+                for (unsigned long p = adj_off[i]; p < adj_off[i+1]; ++p)
                 {
-                    const unsigned long j = g.node(i).neighbor(n).index();
-                    // Don't compute an edge weight more than once. 
+                    const unsigned long j = adj[p];
+                    // Don't compute an edge weight more than once.
                     if (i < j)
                     {
-                        g.node(i).edge(n) = dot(rowm(current_solution,range(0,edge_dims-1)),
-                                                samp.node(i).edge(n));
+                        double score;
+                        if (use_cache)
+                        {
+                            score = edge_scores(next_edge);
+                        }
+                        else
+                        {
+                            // Score the next_edge-th i<j edge from the CSR packed
+                            // copy of the sparse edge vectors.
+                            const std::vector<std::pair<unsigned long,double> >& vals = sparse_edge_vals[idx];
+                            score = 0;
+                            const unsigned long stop = sparse_edge_offsets[idx][next_edge+1];
+                            for (unsigned long k = sparse_edge_offsets[idx][next_edge]; k < stop; ++k)
+                                score += w_edge(vals[k].first)*vals[k].second;
+                        }
+                        // Write through the precomputed slot since the scratch
+                        // graph's neighbor ordering can differ from the sample's.
+                        g.node(i).edge(scratch_edge_pos[idx][next_edge]) = score;
+                        ++next_edge;
                     }
                 }
 
             }
 
-            std::vector<node_label> labeling;
+            std::vector<node_label>& labeling = labeling_scratch[idx];
             find_max_factor_graph_potts(g, labeling);
 
 
-            std::vector<bool> bool_labeling;
-            bool_labeling.reserve(labeling.size());
-            // figure out the loss
+            // Figure out the loss.  Accumulate it arithmetically rather than
+            // branching on each mispredicted node since whether a node is
+            // mispredicted is data dependent and hard for the branch predictor.
+            const std::vector<double>* const sample_losses = (losses.size() != 0) ? &losses[idx] : 0;
             loss = 0;
             for (unsigned long i = 0; i < labeling.size(); ++i)
             {
                 const bool predicted_label = (labeling[i]!= 0);
-                bool_labeling.push_back(predicted_label);
-                loss += get_loss_for_sample(idx, i, predicted_label);
+                const bool true_label = labels[idx][i];
+                const double loss_if_wrong = sample_losses ? (*sample_losses)[i] :
+                                                            (true_label ? loss_pos : loss_neg);
+                loss += (predicted_label != true_label) * loss_if_wrong;
             }
 
-            // compute psi
-            get_joint_feature_vector(samp, bool_labeling, psi);
+            // Compute psi straight from the labeling found above.
+            get_joint_feature_vector(idx, labeling, psi);
         }
 
         double get_loss_for_sample (
@@ -527,6 +867,40 @@ namespace dlib
         const std::vector<label_type>& labels;
         const std::vector<std::vector<double> >& losses;
 
+        // Flattened copies of the dense feature vectors, one matrix per sample.
+        // node_feat[s] has one row per node and edge_feat[s] has one row per i<j
+        // edge, rows being in the order the loops in this class walk the graphs.
+        // These are empty when the feature vectors are sparse.
+        std::vector<matrix<double> > node_feat;
+        std::vector<matrix<double> > edge_feat;
+
+        // CSR style packing of the sparse edge vectors, used when the feature
+        // vectors are sparse.  sparse_edge_vals[s] holds the index/value pairs of
+        // every i<j edge of samples[s] back to back, and sparse_edge_offsets[s][r]
+        // gives the start of the r-th edge's pairs (with one extra entry marking
+        // the end).  These are empty when the feature vectors are dense.
+        std::vector<std::vector<std::pair<unsigned long,double> > > sparse_edge_vals;
+        std::vector<std::vector<unsigned long> > sparse_edge_offsets;
+
+        // Preallocated potts graphs, one per sample, with the same structure as the
+        // corresponding sample.  The separation oracle only rewrites their node and
+        // edge data fields.
+        mutable dlib::array<graph<double,double>::kernel_1a> scratch_graphs;
+
+        // Flat per-sample adjacency arrays.  adj_idx[s] holds the neighbor node
+        // indices of every node of samples[s] back to back and adj_offsets[s][i]
+        // is where node i's neighbors begin (with one extra end entry).
+        std::vector<std::vector<unsigned long> > adj_idx;
+        std::vector<std::vector<unsigned long> > adj_offsets;
+
+        // scratch_edge_pos[s][r] is the neighbor slot in scratch_graphs[s] holding
+        // the r-th i<j edge of samples[s] (in sample walk order), keyed off node i.
+        std::vector<std::vector<unsigned long> > scratch_edge_pos;
+
+        // The labeling produced by the most recent separation oracle call on each
+        // sample.  Reused across calls to avoid reallocating it every time.
+        mutable std::vector<std::vector<node_label> > labeling_scratch;
+
         long node_dims;
         long edge_dims;
         double loss_pos;